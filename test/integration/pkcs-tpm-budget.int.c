@@ -0,0 +1,380 @@
+/* SPDX-License-Identifier: BSD-2 */
+/***********************************************************************
+ * Copyright (c) 2018, Intel Corporation
+ *
+ * All rights reserved.
+ ***********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+
+#include <tss2/tss2_esys.h>
+
+#include "test.h"
+
+/*
+ * These tests assert how many TPM commands each PKCS#11 operation
+ * issues. Wall-clock benchmarks against the simulator hide extra
+ * round trips, a command budget does not.
+ *
+ * The library never exposes its TCTI, so we interpose Esys_Initialize()
+ * and swap the transmit routine of the TCTI handed to it for a counting
+ * one. Every TPM command goes through exactly one transmit, regardless
+ * of how many ESAPI calls are used to set it up, so the count is the
+ * number of round trips to the TPM.
+ */
+static TSS2_TCTI_TRANSMIT_FCN _real_transmit;
+static unsigned long _tpm_cmd_count;
+
+static TSS2_RC counting_transmit(TSS2_TCTI_CONTEXT *tcti_ctx, size_t size,
+        uint8_t const *command) {
+
+    _tpm_cmd_count++;
+
+    return _real_transmit(tcti_ctx, size, command);
+}
+
+typedef TSS2_RC (*esys_init_fn)(ESYS_CONTEXT **esys_context,
+        TSS2_TCTI_CONTEXT *tcti, TSS2_ABI_VERSION *abi_version);
+
+TSS2_RC Esys_Initialize(ESYS_CONTEXT **esys_context, TSS2_TCTI_CONTEXT *tcti,
+        TSS2_ABI_VERSION *abi_version) {
+
+    esys_init_fn real_init = (esys_init_fn)dlsym(RTLD_NEXT, "Esys_Initialize");
+    assert_non_null(real_init);
+
+    if (tcti) {
+        TSS2_TCTI_TRANSMIT_FCN transmit = TSS2_TCTI_TRANSMIT(tcti);
+        assert_non_null(transmit);
+
+        /* every token loads the same TCTI, so they share a transmit routine */
+        if (_real_transmit) {
+            assert_true(transmit == _real_transmit);
+        }
+
+        _real_transmit = transmit;
+        TSS2_TCTI_TRANSMIT(tcti) = counting_transmit;
+    }
+
+    return real_init(esys_context, tcti, abi_version);
+}
+
+/*
+ * Returns the number of TPM commands issued since the last call and
+ * resets the counter.
+ */
+static unsigned long tpm_cmds_take(void) {
+
+    unsigned long cnt = _tpm_cmd_count;
+    _tpm_cmd_count = 0;
+    return cnt;
+}
+
+#define assert_tpm_cmds_equal(expected) \
+    assert_int_equal(tpm_cmds_take(), expected)
+
+#define assert_tpm_cmds_at_most(max) \
+    assert_in_range(tpm_cmds_take(), 0, max)
+
+/*
+ * Budgets, in TPM commands, for operations that are not a fixed cost.
+ *
+ * Login: StartAuthSession, Load and Unseal of the seal object, Load of
+ * the wrapping and secondary objects and an EncryptDecrypt2 (plus
+ * a possible EncryptDecrypt fallback) to unwrap the secondary object auth.
+ */
+#define LOGIN_BUDGET 7
+
+/*
+ * Logout: a FlushContext for every loaded tertiary object, the wrapping
+ * object, the secondary object and the HMAC session.
+ */
+#define LOGOUT_BUDGET(loaded_keys) (3 + (loaded_keys))
+
+/*
+ * Cold key: Load of the tertiary object and the unwrap of its auth.
+ */
+#define KEY_LOAD_BUDGET 3
+
+struct test_info {
+    CK_SESSION_HANDLE handle;
+    CK_SLOT_ID slot_id;
+};
+
+static int group_setup_counting(void **state) {
+
+    int rc = group_setup(state);
+
+    /* make sure the counter is live, else a budget of 0 passes trivially */
+    assert_non_null(_real_transmit);
+
+    return rc;
+}
+
+static int test_setup(void **state) {
+
+    test_info *ti = calloc(1, sizeof(*ti));
+    assert_non_null(ti);
+
+    /* get the slots */
+    CK_SLOT_ID slots[6];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, 3);
+
+    ti->slot_id = slots[0];
+
+    rv = C_OpenSession(ti->slot_id, CKF_SERIAL_SESSION, NULL,
+            NULL, &ti->handle);
+    assert_int_equal(rv, CKR_OK);
+
+    tpm_cmds_take();
+
+    *state = ti;
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+
+    CK_RV rv = C_CloseAllSessions(ti->slot_id);
+    assert_int_equal(rv, CKR_OK);
+
+    free(ti);
+
+    return 0;
+}
+
+static CK_OBJECT_HANDLE find_rsa_private_key(CK_SESSION_HANDLE session) {
+
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_ULONG count;
+    CK_OBJECT_HANDLE objhandles[1];
+    rv = C_FindObjects(session, objhandles, ARRAY_LEN(objhandles), &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, 1);
+
+    rv = C_FindObjectsFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    return objhandles[0];
+}
+
+/*
+ * The message to sign.
+ */
+static const CK_BYTE _data[] = { 'F', 'O', 'O', ' ', 'B', 'A', 'R' };
+
+/*
+ * ASN1 DigestInfo for SHA256 (see rfc3447) of _data, for CKM_RSA_PKCS.
+ */
+static const CK_BYTE _digest_info_sha256[] = {
+    0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03,
+    0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20,
+
+    0x8d, 0x35, 0xc9, 0x7b, 0xcd, 0x90, 0x2b, 0x96, 0xd1, 0xb5, 0x51, 0x74,
+    0x1b, 0xbe, 0x8a, 0x7f, 0x50, 0xbb, 0x5a, 0x69, 0x0b, 0x4d, 0x02, 0x25,
+    0x48, 0x2e, 0xaa, 0x63, 0xdb, 0xfb, 0x9d, 0xed
+};
+
+static void test_find_objects_budget(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    /* object metadata lives in the store, searching must never hit the TPM */
+    CK_OBJECT_HANDLE key = find_rsa_private_key(session);
+    assert_tpm_cmds_equal(0);
+
+    CK_KEY_TYPE key_type = 0;
+    CK_ATTRIBUTE attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+    CK_RV rv = C_GetAttributeValue(session, key, &attr, 1);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(key_type, CKK_RSA);
+    assert_tpm_cmds_equal(0);
+
+    /* nor should it once logged in */
+    user_login(session);
+    tpm_cmds_take();
+
+    find_rsa_private_key(session);
+    assert_tpm_cmds_equal(0);
+
+    logout(session);
+}
+
+static void test_session_info_budget(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+
+    CK_TOKEN_INFO tinfo;
+    CK_RV rv = C_GetTokenInfo(ti->slot_id, &tinfo);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_SESSION_INFO sinfo;
+    rv = C_GetSessionInfo(ti->handle, &sinfo);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(ti->slot_id, CKF_SERIAL_SESSION, NULL,
+            NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_tpm_cmds_equal(0);
+}
+
+static void test_login_logout_budget(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    user_login(session);
+    assert_tpm_cmds_at_most(LOGIN_BUDGET);
+
+    logout(session);
+    assert_tpm_cmds_at_most(LOGOUT_BUDGET(0));
+
+    /* a bad pin is caught in software before any TPM work */
+    user_login_bad_pin(session);
+    assert_tpm_cmds_equal(0);
+}
+
+static void test_sign_CKM_RSA_PKCS_warm_key_budget(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    CK_OBJECT_HANDLE key = find_rsa_private_key(session);
+
+    user_login(session);
+    tpm_cmds_take();
+
+    CK_MECHANISM mech = { .mechanism = CKM_RSA_PKCS };
+
+    CK_BYTE sig[4096];
+    CK_ULONG siglen = sizeof(sig);
+
+    /* the first use of the key pays for loading it */
+    CK_RV rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_at_most(KEY_LOAD_BUDGET);
+
+    rv = C_Sign(session, (CK_BYTE_PTR)_digest_info_sha256,
+            sizeof(_digest_info_sha256), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    /* a warm key signs in exactly one round trip: RSA_Decrypt */
+    siglen = sizeof(sig);
+    rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_Sign(session, (CK_BYTE_PTR)_digest_info_sha256,
+            sizeof(_digest_info_sha256), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    logout(session);
+    assert_tpm_cmds_at_most(LOGOUT_BUDGET(1));
+}
+
+static void test_sign_verify_CKM_SHA256_RSA_PKCS_warm_key_budget(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    CK_OBJECT_HANDLE key = find_rsa_private_key(session);
+
+    user_login(session);
+
+    CK_MECHANISM mech = { .mechanism = CKM_SHA256_RSA_PKCS };
+
+    CK_BYTE sig[4096];
+    CK_ULONG siglen = sizeof(sig);
+
+    /* warm the key up */
+    CK_RV rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_Sign(session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    tpm_cmds_take();
+
+    /* HashSequenceStart */
+    siglen = sizeof(sig);
+    rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    /* SequenceUpdate, SequenceComplete and Sign */
+    rv = C_Sign(session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(3);
+
+    /* multi-part costs one SequenceUpdate per part that fits a TPM buffer */
+    siglen = sizeof(sig);
+    rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    rv = C_SignUpdate(session, (CK_BYTE_PTR)_data, 3);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    rv = C_SignUpdate(session, (CK_BYTE_PTR)&_data[3], sizeof(_data) - 3);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    rv = C_SignFinal(session, sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(2);
+
+    /* HashSequenceStart */
+    rv = C_VerifyInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(1);
+
+    /* SequenceUpdate, SequenceComplete and VerifySignature */
+    rv = C_Verify(session, (CK_BYTE_PTR)_data, sizeof(_data), sig, siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_tpm_cmds_equal(3);
+
+    logout(session);
+    assert_tpm_cmds_at_most(LOGOUT_BUDGET(1));
+}
+
+int main() {
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_find_objects_budget,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_session_info_budget,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_login_logout_budget,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_sign_CKM_RSA_PKCS_warm_key_budget,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_sign_verify_CKM_SHA256_RSA_PKCS_warm_key_budget,
+                test_setup, test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, group_setup_counting, group_teardown);
+}